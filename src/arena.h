@@ -0,0 +1,144 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace std;
+
+// One anonymous mapping that buffers are carved out of in 64-byte aligned pieces and released all at once
+// when the arena goes away. Explicit huge pages (MAP_HUGETLB) are used if the system has them reserved,
+// otherwise the region is 2 MiB aligned and handed to transparent huge pages with MADV_HUGEPAGE, falling
+// back to normal pages if neither is available. The region is populated up front.
+class arena
+{
+private:
+  static constexpr size_t huge_page = 2 << 20;
+
+  char* _map = NULL;
+  size_t _map_size = 0;
+  char* _base = NULL;
+  size_t _size = 0;
+  size_t _used = 0;
+  bool _hugetlb = false;
+
+public:
+  static constexpr size_t alignment = 64;
+
+  static size_t aligned(size_t bytes) { return (bytes + alignment - 1) / alignment * alignment; }
+
+  arena(size_t bytes)
+  {
+    _size = max(aligned(bytes), alignment);
+    size_t huge_size = (_size + huge_page - 1) / huge_page * huge_page;
+    void* addr = mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+    if (addr != MAP_FAILED) {
+      _hugetlb = true;
+      _map = _base = static_cast<char*>(addr);
+      _map_size = _size = huge_size;
+      return;
+    }
+
+    // Over-map by one huge page so the region can start on a huge page boundary
+    _map_size = huge_size + huge_page;
+    addr = mmap(NULL, _map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+      cerr << "ERROR: Could not map a " << _size << " byte arena" << endl;
+      exit(EXIT_FAILURE);
+    }
+    _map = static_cast<char*>(addr);
+    _base = _map + (huge_page - reinterpret_cast<uintptr_t>(_map) % huge_page) % huge_page;
+    madvise(_base, huge_size, MADV_HUGEPAGE);
+    for (size_t offset = 0; offset < _size; offset += sysconf(_SC_PAGESIZE))
+      _base[offset] = 0;
+  }
+
+  arena(const arena&) = delete;
+  arena& operator=(const arena&) = delete;
+  ~arena() { munmap(_map, _map_size); }
+
+  // n zeroed, 64-byte aligned Ts
+  template<typename T> T* allocate(size_t n)
+  {
+    size_t bytes = aligned(n * sizeof(T));
+    if (_used + bytes > _size) {
+      cerr << "ERROR: Arena of " << _size << " bytes exhausted" << endl;
+      exit(EXIT_FAILURE);
+    }
+    T* p = reinterpret_cast<T*>(_base + _used);
+    _used += bytes;
+    return p;
+  }
+
+  size_t size() { return _size; }
+  size_t used() { return _used; }
+
+  // Resident bytes of the arena and how many of them are backed by huge pages, from /proc/self/smaps
+  void page_usage(size_t& resident, size_t& huge)
+  {
+    resident = huge = 0;
+    ifstream smaps("/proc/self/smaps");
+    string line;
+    bool in_arena = false;
+    while (getline(smaps, line)) {
+      // Mapping headers start with "start-end", the fields of the mapping with "Key:"
+      istringstream fields(line);
+      string key;
+      fields >> key;
+      if (key.empty())
+        continue;
+      if (key.back() != ':') {
+        uintptr_t start = stoull(key, NULL, 16), end = stoull(key.substr(key.find('-') + 1), NULL, 16);
+        in_arena = start < (uintptr_t) (_base + _size) && end > (uintptr_t) _base;
+        continue;
+      }
+      size_t kb = 0;
+      fields >> kb;
+      if (!in_arena)
+        continue;
+      if (key == "Rss:")
+        resident += kb << 10;
+      else if (key == "AnonHugePages:" || key == "Private_Hugetlb:")
+        huge += kb << 10;
+    }
+    if (_hugetlb)
+      resident = max(resident, huge);
+  }
+
+  // One line summary of size, use and page backing for the stats output
+  void report(ostream& out)
+  {
+    size_t resident, huge;
+    page_usage(resident, huge);
+    out << "[*] Arena: " << fixed << setprecision(1) << _size / 1048576.0 << " MiB (" << _used / 1048576.0
+        << " MiB used), " << resident / 1048576.0 << " MiB resident, " << huge / 1048576.0 << " MiB in "
+        << (_hugetlb ? "explicit" : "transparent") << " huge pages" << endl;
+  }
+};
+
+// Allocator handing out arena memory to standard containers. Memory goes back to the arena only when the
+// arena is destroyed, so containers using it must not outlive it and shouldn't grow after their first
+// allocation.
+template<typename T> struct arena_allocator {
+  typedef T value_type;
+  arena* _arena;
+
+  arena_allocator(arena& a) : _arena(&a) {}
+  template<typename U> arena_allocator(const arena_allocator<U>& other) : _arena(other._arena) {}
+
+  T* allocate(size_t n) { return _arena->allocate<T>(n); }
+  void deallocate(T*, size_t) {}
+
+  template<typename U> bool operator==(const arena_allocator<U>& other) const
+  {
+    return _arena == other._arena;
+  }
+  template<typename U> bool operator!=(const arena_allocator<U>& other) const { return !(*this == other); }
+};
@@ -3,12 +3,12 @@
 
 #include "base64.h"
 
-string b64::encode(const vector<u8>& bytes)
+string b64::encode(const u8* bytes, size_t bytes_len)
 {
   string encoded;
+  encoded.reserve((bytes_len + 2) / 3 * 4);
   int i = 0, j = 0;
   unsigned char chunk3b[3], chunk4b[4];
-  size_t bytes_len = bytes.size();
 
   size_t bi = 0;
   while (bytes_len--) {
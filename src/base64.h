@@ -18,7 +18,8 @@ public:
   b64() {}
   b64(const string& b64_chars) : b64_idx(b64_chars) {}
   inline bool is_b64(char c) { return (isalnum(c) || (c == '+') || (c == '/')); }
-  string encode(const vector<u8>& bytes);
+  string encode(const vector<u8>& bytes) { return encode(bytes.data(), bytes.size()); }
+  string encode(const u8* bytes, size_t bytes_len);
   string decode(const string& encoded);
   string idx() { return b64_idx; }
 };
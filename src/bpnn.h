@@ -1,53 +1,152 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
+#include <random>
 #include <vector>
 
 #include "perceptron.h"
 
 using namespace std;
 
+// Largest layer a sparse neuron can be wired into, as connections are stored one byte each
+const size_t max_sparse_inputs = 256;
+
+// Wire each of num_neurons neurons to k distinct inputs out of num_inputs (at most max_sparse_inputs),
+// picked by a partial Fisher-Yates shuffle driven by mt19937 (whose output is fixed by the standard) so
+// the same seed gives the same wiring everywhere and a sparse network only needs to store its seed. The
+// inputs of neuron j are connections[j * k, (j + 1) * k).
+inline vector<uint8_t> sparse_connections(size_t num_neurons, size_t num_inputs, size_t k, uint32_t seed)
+{
+  mt19937 gen(seed);
+  vector<uint8_t> connections(num_neurons * k);
+  vector<uint8_t> idx(num_inputs);
+  for (size_t neuron_idx = 0; neuron_idx < num_neurons; neuron_idx++) {
+    iota(idx.begin(), idx.end(), 0);
+    for (size_t c = 0; c < k; c++)
+      swap(idx[c], idx[c + gen() % (num_inputs - c)]);
+    copy(idx.begin(), idx.begin() + k, connections.begin() + neuron_idx * k);
+  }
+  return connections;
+}
+
 template<typename T> class bpnn
 {
 private:
   vector<vector<perceptron<T>>> _net;
+  size_t _sparse = 0;
+  uint32_t _seed = 0;
+  vector<uint8_t> _connections; // inputs of sparse output neurons, see sparse_connections
+  bool _frozen = false;
+
+  // Update neuron from the inputs x it sees (gathered for a sparse neuron, see gather). The bias is left
+  // as initialized, as fixed_bpnn and tiled_layer do.
+  void update_neuron(perceptron<T>& neuron, const vector<T>& x, T learning_rate)
+  {
+    for (size_t input_idx = 0; input_idx < neuron.num_inputs(); input_idx++)
+      neuron.weight(input_idx, neuron.weight(input_idx) + learning_rate * neuron.delta() * x[input_idx]);
+  }
 
 public:
-  bpnn(const vector<size_t>& shape)
+  // sparse > 0 connects every output neuron to only that many inputs of the last hidden layer, wired from
+  // seed by sparse_connections
+  bpnn(const vector<size_t>& shape, size_t sparse = 0, uint32_t seed = 0)
   {
     for (size_t layer_idx = 0; layer_idx < shape.size() - 1; layer_idx++) {
+      bool sparse_layer = sparse && layer_idx == shape.size() - 2;
       vector<perceptron<T>> layer;
       for (size_t j = 0; j < shape[layer_idx + 1]; j++)
-        layer.push_back(perceptron<T>(shape[layer_idx]));
+        layer.push_back(perceptron<T>(sparse_layer ? sparse : shape[layer_idx]));
       _net.push_back(layer);
     }
+    if (sparse)
+      connect_output_layer(shape[shape.size() - 2], sparse, seed);
   }
 
+  bpnn(const vector<vector<perceptron<T>>>& net) : _net(net) {}
+
   vector<T> forward(const vector<T>& inputs)
+  {
+    vector<T> x = forward_hidden(inputs);
+    if (_net.empty())
+      return x;
+    return forward_range_from(x, 0, _net.back().size());
+  }
+
+  // Forward inputs through every layer but the last, returning what the last layer sees
+  vector<T> forward_hidden(const vector<T>& inputs)
   {
     vector<T> x(inputs.begin(), inputs.end());
-    for (auto& layer : _net) {
+    for (size_t layer = 0; layer + 1 < _net.size(); layer++) {
       vector<T> layer_outs;
-      for (auto& neuron : layer)
+      for (auto& neuron : _net[layer])
         layer_outs.push_back(neuron.activate(x));
       x = layer_outs;
     }
     return x;
   }
 
+  // Forward inputs through the network but only evaluate neurons [first, last) of the last layer
+  vector<T> forward_range(const vector<T>& inputs, size_t first, size_t last)
+  {
+    return forward_range_from(forward_hidden(inputs), first, last);
+  }
+
+  // Activate neurons [first, last) of the last layer on the activations x of the layer below
+  vector<T> forward_range_from(const vector<T>& x, size_t first, size_t last)
+  {
+    vector<T> outs, buf;
+    for (size_t neuron_idx = first; neuron_idx < last; neuron_idx++)
+      outs.push_back(_net.back()[neuron_idx].activate(gather(neuron_idx, x, buf)));
+    return outs;
+  }
+
+  // What output neuron j sees of the activations x of the layer below: x itself in a dense layer, its
+  // connected inputs gathered into buf in a sparse one
+  const vector<T>& gather(size_t j, const vector<T>& x, vector<T>& buf)
+  {
+    if (!_sparse)
+      return x;
+    buf.resize(_sparse);
+    for (size_t c = 0; c < _sparse; c++)
+      buf[c] = x[_connections[j * _sparse + c]];
+    return buf;
+  }
+
   void backward(const vector<T>& expected)
   {
-    for (int layer_idx = _net.size() - 1; layer_idx >= 0; --layer_idx) {
+    vector<T> errors;
+    for (size_t neuron_idx = 0; neuron_idx < _net.back().size(); neuron_idx++)
+      errors.push_back(expected[neuron_idx] - _net.back()[neuron_idx].output());
+    backward_errors(errors);
+  }
+
+  // Backpropagate errors observed at the outputs of the last layer (used when the layer above lives
+  // outside of this network, e.g. a tiled output layer). If active is given, only those last layer
+  // neurons take part. Frozen hidden layers get no deltas.
+  void backward_errors(const vector<T>& output_errors, const vector<size_t>* active = nullptr)
+  {
+    int top = _net.size() - 1;
+    int bottom = _frozen ? top : 0;
+    for (int layer_idx = top; layer_idx >= bottom; --layer_idx) {
       vector<T> errors;
-      if (layer_idx != (int) (_net.size() - 1)) {
-        for (int neuron_idx = 0; neuron_idx < (int) _net[layer_idx].size(); neuron_idx++) {
-          T error = 0.0;
-          for (auto& neuron : _net[layer_idx + 1])
-            error += (neuron.weight(neuron_idx) * neuron.delta());
-          errors.push_back(error);
-        }
+      if (layer_idx != top) {
+        // Every neuron of the layer above adds its weighted delta to the inputs it's connected to
+        errors.assign(_net[layer_idx].size(), 0.0);
+        bool sparse = _sparse && layer_idx + 1 == top;
+        auto backpropagate = [&](size_t neuron_idx) {
+          perceptron<T>& neuron = _net[layer_idx + 1][neuron_idx];
+          for (size_t c = 0; c < neuron.num_inputs(); c++)
+            errors[sparse ? _connections[neuron_idx * _sparse + c] : c] += neuron.weight(c) * neuron.delta();
+        };
+        if (layer_idx + 1 == top && active)
+          for (size_t active_idx : *active)
+            backpropagate(active_idx);
+        else
+          for (size_t neuron_idx = 0; neuron_idx < _net[layer_idx + 1].size(); neuron_idx++)
+            backpropagate(neuron_idx);
       } else {
-        for (size_t neuron_idx = 0; neuron_idx < _net[layer_idx].size(); neuron_idx++)
-          errors.push_back(expected[neuron_idx] - _net[layer_idx][neuron_idx].output());
+        errors = output_errors;
       }
 
       for (size_t neuron_idx = 0; neuron_idx < _net[layer_idx].size(); neuron_idx++)
@@ -56,20 +155,28 @@ public:
     }
   }
 
-  void update_weights(const vector<T>& inputs, T learning_rate)
+  void update_weights(const vector<T>& inputs, T learning_rate, const vector<size_t>* active = nullptr)
   {
     auto x = inputs;
-    for (size_t layer = 0; layer < _net.size(); layer++) {
+    for (size_t layer = _frozen ? _net.size() - 1 : 0; layer < _net.size(); layer++) {
       if (layer != 0) {
         x = vector<T>();
         for (auto& neuron : _net[layer - 1])
           x.push_back(neuron.output());
       }
 
-      for (auto& neuron : _net[layer]) {
-        for (size_t input_idx = 0; input_idx < x.size(); input_idx++)
-          neuron.weight(input_idx, neuron.weight(input_idx) + learning_rate * neuron.delta() * x[input_idx]);
-        neuron.weight(x.size() + 1, neuron.weight(x.size() + 1) + learning_rate * neuron.delta());
+      bool top = layer == _net.size() - 1;
+      vector<T> buf;
+      auto update = [&](size_t neuron_idx) {
+        const vector<T>& seen = top ? gather(neuron_idx, x, buf) : x;
+        update_neuron(_net[layer][neuron_idx], seen, learning_rate);
+      };
+      if (top && active) {
+        for (size_t active_idx : *active)
+          update(active_idx);
+      } else {
+        for (size_t neuron_idx = 0; neuron_idx < _net[layer].size(); neuron_idx++)
+          update(neuron_idx);
       }
     }
   }
@@ -99,6 +206,115 @@ public:
     cout << endl;
   }
 
+  // Like train, but output neurons already within margin of their target are left out of the backward pass
+  // and weight update. They are still evaluated every iteration, so one that drifts out of margin as the
+  // hidden layers move rejoins the active set. Training stops early once no neuron is active, and the
+  // progress line is kept every 1000 iterations to show how the active set shrinks.
+  void train_active(const vector<vector<T>>& inputs, const vector<vector<T>>& expected,
+                    size_t iterations = 3000, T lrate = 0.01, T margin = 0.002)
+  {
+    for (size_t iter = 0; iter < iterations; iter++) {
+      T sum_error = 0;
+      size_t num_active = 0;
+      for (size_t sample_idx = 0; sample_idx < inputs.size(); sample_idx++) {
+        auto outputs = forward(inputs[sample_idx]);
+        vector<T> errors;
+        vector<size_t> active;
+        for (size_t output_idx = 0; output_idx < outputs.size(); output_idx++) {
+          errors.push_back(expected[sample_idx][output_idx] - outputs[output_idx]);
+          sum_error += errors.back() * errors.back();
+          if (fabs(errors.back()) >= margin)
+            active.push_back(output_idx);
+        }
+        if (!active.empty()) {
+          backward_errors(errors, &active);
+          update_weights(inputs[sample_idx], lrate, &active);
+        }
+        num_active += active.size();
+      }
+      cout << ">iter=" << iter << ", lrate=" << fixed << setprecision(3) << lrate << ", error=" << fixed
+           << setprecision(3) << sum_error << ", active=" << num_active << (iter % 1000 ? "\r" : "\n");
+      if (!num_active)
+        break;
+    }
+    cout << endl;
+  }
+
+  // Fit the last layer to a single sample analytically instead of training it. With the activations h of
+  // the layer below fixed, output neuron j needs tanh(w.h) = expected[j] - bias, so w is moved along h by
+  // the minimum-norm step (damped by ridge) that puts w.h on atanh(expected[j] - bias).
+  void solve_output_layer(const vector<T>& inputs, const vector<T>& expected, T ridge = 0)
+  {
+    forward(inputs);
+    vector<T> h = inputs;
+    if (_net.size() > 1) {
+      h.clear();
+      for (auto& neuron : _net[_net.size() - 2])
+        h.push_back(neuron.output());
+    }
+
+    T dense_norm = inner_product(h.begin(), h.end(), h.begin(), 0.0) + ridge;
+    vector<T> buf;
+    for (size_t neuron_idx = 0; neuron_idx < _net.back().size(); neuron_idx++) {
+      auto& neuron = _net.back()[neuron_idx];
+      size_t n = neuron.num_inputs();
+      const vector<T>& seen = gather(neuron_idx, h, buf);
+      T target = atanh(clamp<T>(expected[neuron_idx] - neuron.weight(n), -1 + 1e-6, 1 - 1e-6));
+      T norm = _sparse ? inner_product(seen.begin(), seen.end(), seen.begin(), 0.0) + ridge : dense_norm;
+      T step = (target - neuron.weighted_sum(seen)) / norm;
+      for (size_t c = 0; c < n; c++)
+        neuron.weight(c, neuron.weight(c) + step * seen[c]);
+    }
+  }
+
+  // Rewire the last layer to k inputs per neuron from seed, see sparse_connections. Its neurons must
+  // already have k weights plus bias.
+  void connect_output_layer(size_t num_inputs, size_t k, uint32_t seed)
+  {
+    _connections = sparse_connections(_net.back().size(), num_inputs, k, seed);
+    _sparse = k;
+    _seed = seed;
+  }
+
+  // Keep every layer but the last at its current weights during training, e.g. a hidden stack loaded from
+  // a template
+  void freeze_hidden(bool frozen) { _frozen = frozen; }
+  bool hidden_frozen() { return _frozen; }
+
+  // Connections per output neuron, 0 if the last layer is dense
+  size_t sparse() { return _sparse; }
+  uint32_t seed() { return _seed; }
+  // Inputs of every sparse output neuron, see sparse_connections
+  const vector<uint8_t>& connections() { return _connections; }
+
+  // Inputs of the first layer followed by the width of every layer
+  vector<size_t> shape()
+  {
+    vector<size_t> s = {_net.empty() ? 0 : _net[0][0].weights().size() - 1};
+    for (auto& layer : _net)
+      s.push_back(layer.size());
+    return s;
+  }
+
   vector<vector<perceptron<T>>>& net() { return _net; };
   void net(vector<vector<perceptron<T>>>& net) { _net = net; };
 };
+
+// Evaluate the last layers of several networks on the same activations h of the layer below, i.e. networks
+// that share their hidden stack and magic inputs (as networks stegged from one template do), so h only has
+// to be computed once for all of them. Each output is the neuron's weighted sum of h plus its bias; unlike
+// activate nothing is kept for training, which saves evaluating the derivative of every output neuron.
+template<typename T> vector<vector<T>> forward_output_batch(const vector<bpnn<T>*>& nets, const vector<T>& h)
+{
+  vector<vector<T>> outs(nets.size());
+  vector<T> buf;
+  for (size_t net_idx = 0; net_idx < nets.size(); net_idx++) {
+    auto& layer = nets[net_idx]->net().back();
+    outs[net_idx].reserve(layer.size());
+    for (size_t j = 0; j < layer.size(); j++) {
+      T sum = layer[j].weighted_sum(nets[net_idx]->gather(j, h, buf));
+      outs[net_idx].push_back(tanh(sum) + layer[j].weight(layer[j].num_inputs()));
+    }
+  }
+  return outs;
+}
@@ -0,0 +1,326 @@
+#pragma once
+
+#include <array>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "arena.h"
+#include "bpnn.h"
+#include "maths.h"
+
+using namespace std;
+
+// Fully connected layer with compile-time sizes. Same math as perceptron: tanh on the weighted sum with
+// the bias added afterwards, derivative taken on the output, and the bias left as initialized.
+template<typename T, size_t In, size_t Out> struct fixed_layer {
+  alignas(arena::alignment) array<array<T, In>, Out> w;
+  array<T, Out> bias;
+  array<T, Out> out;
+  array<T, Out> delta;
+
+  void forward(const array<T, In>& x)
+  {
+    for (size_t o = 0; o < Out; o++) {
+      T z = 0;
+      for (size_t i = 0; i < In; i++)
+        z += w[o][i] * x[i];
+      out[o] = tanh(z) + bias[o];
+    }
+  }
+
+  void backward(const array<T, Out>& errors)
+  {
+    for (size_t o = 0; o < Out; o++)
+      delta[o] = errors[o] * sech(out[o]);
+  }
+
+  // Errors this layer backpropagates into its inputs
+  array<T, In> input_errors()
+  {
+    array<T, In> errors = {};
+    for (size_t o = 0; o < Out; o++)
+      for (size_t i = 0; i < In; i++)
+        errors[i] += w[o][i] * delta[o];
+    return errors;
+  }
+
+  void update(const array<T, In>& x, T learning_rate)
+  {
+    for (size_t o = 0; o < Out; o++)
+      for (size_t i = 0; i < In; i++)
+        w[o][i] += learning_rate * delta[o] * x[i];
+  }
+
+  void load(vector<perceptron<T>>& layer)
+  {
+    for (size_t o = 0; o < Out; o++) {
+      vector<T> weights = layer[o].weights();
+      copy(weights.begin(), weights.begin() + In, w[o].begin());
+      bias[o] = weights[In];
+    }
+  }
+
+  void store(vector<perceptron<T>>& layer)
+  {
+    for (size_t o = 0; o < Out; o++) {
+      vector<T> weights(w[o].begin(), w[o].end());
+      weights.push_back(bias[o]);
+      layer[o].weights(weights);
+    }
+  }
+};
+
+// Stack of fixed layers for the shape In, Rest... (one layer per consecutive pair of sizes)
+template<typename T, size_t In, size_t... Rest> struct fixed_stack {
+  static constexpr size_t outputs = In;
+
+  const array<T, In>& forward(const array<T, In>& x) { return x; }
+  void backward(const array<T, In>&) {}
+  array<T, In> input_errors(const array<T, In>& errors) { return errors; }
+  void update(const array<T, In>&, T) {}
+  void load(vector<vector<perceptron<T>>>&, size_t) {}
+  void store(vector<vector<perceptron<T>>>&, size_t) {}
+};
+
+template<typename T, size_t In, size_t Out, size_t... Rest> struct fixed_stack<T, In, Out, Rest...> {
+  static constexpr size_t outputs = fixed_stack<T, Out, Rest...>::outputs;
+  fixed_layer<T, In, Out> layer;
+  fixed_stack<T, Out, Rest...> next;
+
+  const array<T, outputs>& forward(const array<T, In>& x)
+  {
+    layer.forward(x);
+    return next.forward(layer.out);
+  }
+
+  void backward(const array<T, outputs>& errors)
+  {
+    next.backward(errors);
+    layer.backward(next.input_errors(errors));
+  }
+
+  array<T, In> input_errors(const array<T, outputs>&) { return layer.input_errors(); }
+
+  void update(const array<T, In>& x, T learning_rate)
+  {
+    layer.update(x, learning_rate);
+    next.update(layer.out, learning_rate);
+  }
+
+  void load(vector<vector<perceptron<T>>>& net, size_t layer_idx)
+  {
+    layer.load(net[layer_idx]);
+    next.load(net, layer_idx + 1);
+  }
+
+  void store(vector<vector<perceptron<T>>>& net, size_t layer_idx)
+  {
+    layer.store(net[layer_idx]);
+    next.store(net, layer_idx + 1);
+  }
+};
+
+// bpnn whose inputs and hidden stack have the compile-time shape In, Hidden... and whose output layer is
+// sized at runtime. The hidden layers live in std::arrays so their loops have constant bounds. Output
+// weights are stored in blocks of `lanes` neurons laid out input-major ({ w[j][0] for the block, w[j][1]
+// ..., }), so the weighted sums of a whole block accumulate side by side in one vector register instead
+// of as a serial reduction per neuron; biases are kept apart. A sparse output layer stores its k
+// connected weights per neuron the same way, next to a byte per weight naming the hidden unit it reads.
+// The output weights, connections, biases and outputs are carved out of one arena, so every block starts
+// on a 64-byte boundary and the whole layer sits on as few (huge) pages as possible. It is built from and
+// written back to a generic bpnn of the same shape, see train_network in main.cc for the dispatch.
+template<typename T, size_t In, size_t... Hidden> class fixed_bpnn
+{
+private:
+  typedef fixed_stack<T, In, Hidden...> stack;
+  typedef vector<T, arena_allocator<T>> buffer;
+  typedef vector<uint8_t, arena_allocator<uint8_t>> index_buffer;
+  static constexpr size_t H = stack::outputs;
+  static constexpr size_t lanes = 8;
+
+  stack _hidden;
+  array<T, In> _input;
+  size_t _outputs;
+  size_t _blocks;
+  size_t _sparse; // connections per output neuron, 0 if dense
+  size_t _row;    // weights per output neuron
+  bool _frozen;
+  arena _arena;
+  buffer _w;
+  index_buffer _idx; // hidden unit each sparse weight reads, laid out as _w
+  buffer _bias;
+  buffer _out;
+
+  T& weight(size_t j, size_t c) { return _w[(j / lanes) * _row * lanes + c * lanes + j % lanes]; }
+
+  const array<T, H>& forward_hidden(const vector<T>& inputs)
+  {
+    copy(inputs.begin(), inputs.begin() + In, _input.begin());
+    return _hidden.forward(_input);
+  }
+
+  // Weighted sums of the block of neurons whose weights start at w
+  array<T, lanes> block_sums(const T* w, const array<T, H>& h)
+  {
+    array<T, lanes> z = {};
+    for (size_t i = 0; i < H; i++)
+      for (size_t l = 0; l < lanes; l++)
+        z[l] += w[i * lanes + l] * h[i];
+    return z;
+  }
+
+  // Same for a block of sparse neurons whose connections start at idx
+  array<T, lanes> sparse_block_sums(const T* w, const uint8_t* idx, const array<T, H>& h)
+  {
+    array<T, lanes> z = {};
+    for (size_t c = 0; c < _sparse; c++)
+      for (size_t l = 0; l < lanes; l++)
+        z[l] += w[c * lanes + l] * h[idx[c * lanes + l]];
+    return z;
+  }
+
+  array<T, lanes> sums(size_t b, const array<T, H>& h)
+  {
+    size_t offset = b * _row * lanes;
+    return _sparse ? sparse_block_sums(&_w[offset], &_idx[offset], h) : block_sums(&_w[offset], h);
+  }
+
+public:
+  // Bytes of arena needed for an output layer of this many neurons with sparse connections each (0 if
+  // dense)
+  static size_t arena_bytes(size_t outputs, size_t sparse = 0)
+  {
+    size_t weights = (outputs + lanes - 1) / lanes * (sparse ? sparse : H) * lanes;
+    return arena::aligned(weights * sizeof(T)) + (sparse ? arena::aligned(weights) : 0) +
+           2 * arena::aligned(outputs * sizeof(T));
+  }
+
+  fixed_bpnn(bpnn<T>& nn)
+      : _outputs(nn.net().back().size()), _blocks((_outputs + lanes - 1) / lanes), _sparse(nn.sparse()),
+        _row(_sparse ? _sparse : H), _frozen(nn.hidden_frozen()), _arena(arena_bytes(_outputs, _sparse)),
+        _w(_blocks * _row * lanes, 0, _arena), _idx(_sparse ? _w.size() : 0, 0, _arena),
+        _bias(_outputs, 0, _arena), _out(_outputs, 0, _arena)
+  {
+    auto& net = nn.net();
+    _hidden.load(net, 0);
+    const vector<uint8_t>& connections = nn.connections();
+    for (size_t j = 0; j < _outputs; j++) {
+      vector<T> weights = net.back()[j].weights();
+      for (size_t c = 0; c < _row; c++)
+        weight(j, c) = weights[c];
+      for (size_t c = 0; c < _sparse; c++)
+        _idx[(j / lanes) * _row * lanes + c * lanes + j % lanes] = connections[j * _sparse + c];
+      _bias[j] = weights[_row];
+    }
+  }
+
+  // True if nn can be run by this specialization: same hidden shape, with a dense or sparse output layer
+  static bool matches(bpnn<T>& nn)
+  {
+    vector<size_t> shape = nn.shape();
+    return shape.size() == sizeof...(Hidden) + 2 &&
+           vector<size_t>(shape.begin(), shape.end() - 1) == vector<size_t>{In, Hidden...};
+  }
+
+  // One SGD step on a single sample. Output neurons within margin of their target are skipped and counted
+  // out of num_active. Hidden errors are accumulated with the output weights from before their update, as
+  // bpnn does, and the hidden stack is left alone if it was frozen in the bpnn this was built from.
+  T train_one(const vector<T>& inputs, const vector<T>& expected, T learning_rate, T margin = 0,
+              size_t* num_active = NULL)
+  {
+    const array<T, H>& h = forward_hidden(inputs);
+    array<T, H> errors = {};
+    T sum = 0;
+    size_t active = 0;
+    for (size_t b = 0; b < _blocks; b++) {
+      T* w = &_w[b * _row * lanes];
+      array<T, lanes> z = sums(b, h);
+      array<T, lanes> delta = {};
+      bool block_active = false;
+      for (size_t l = 0, j = b * lanes; l < lanes && j < _outputs; l++, j++) {
+        _out[j] = tanh(z[l]) + _bias[j];
+        T error = expected[j] - _out[j];
+        sum += error * error;
+        if (fabs(error) < margin)
+          continue;
+        active++;
+        block_active = true;
+        delta[l] = error * sech(_out[j]);
+      }
+      if (!block_active)
+        continue;
+      if (_sparse) {
+        const uint8_t* idx = &_idx[b * _row * lanes];
+        for (size_t c = 0; c < _sparse * lanes; c++) {
+          errors[idx[c]] += w[c] * delta[c % lanes];
+          w[c] += learning_rate * delta[c % lanes] * h[idx[c]];
+        }
+        continue;
+      }
+      for (size_t i = 0; i < H; i++) {
+        T error = 0;
+        for (size_t l = 0; l < lanes; l++) {
+          error += w[i * lanes + l] * delta[l];
+          w[i * lanes + l] += learning_rate * delta[l] * h[i];
+        }
+        errors[i] += error;
+      }
+    }
+    if (num_active)
+      *num_active += active;
+    if (active && !_frozen) {
+      _hidden.backward(errors);
+      _hidden.update(_input, learning_rate);
+    }
+    return sum;
+  }
+
+  void train(const vector<vector<T>>& inputs, const vector<vector<T>>& expected, size_t iterations = 3000,
+             T lrate = 0.01)
+  {
+    for (size_t iter = 0; iter < iterations; iter++) {
+      T sum_error = 0;
+      for (size_t sample_idx = 0; sample_idx < inputs.size(); sample_idx++) {
+        sum_error += train_one(inputs[sample_idx], expected[sample_idx], lrate, 0, NULL);
+        cout << ">iter=" << iter << ", lrate=" << fixed << setprecision(3) << lrate << ", error=" << fixed
+             << setprecision(3) << sum_error << "\r";
+      }
+    }
+    cout << endl;
+  }
+
+  // Same as bpnn::train_active
+  void train_active(const vector<vector<T>>& inputs, const vector<vector<T>>& expected,
+                    size_t iterations = 3000, T lrate = 0.01, T margin = 0.002)
+  {
+    for (size_t iter = 0; iter < iterations; iter++) {
+      T sum_error = 0;
+      size_t num_active = 0;
+      for (size_t sample_idx = 0; sample_idx < inputs.size(); sample_idx++)
+        sum_error += train_one(inputs[sample_idx], expected[sample_idx], lrate, margin, &num_active);
+      cout << ">iter=" << iter << ", lrate=" << fixed << setprecision(3) << lrate << ", error=" << fixed
+           << setprecision(3) << sum_error << ", active=" << num_active << (iter % 1000 ? "\r" : "\n");
+      if (!num_active)
+        break;
+    }
+    cout << endl;
+  }
+
+  arena& memory() { return _arena; }
+
+  // Write the weights back into the bpnn this was built from
+  void store(bpnn<T>& nn)
+  {
+    auto& net = nn.net();
+    _hidden.store(net, 0);
+    for (size_t j = 0; j < _outputs; j++) {
+      vector<T> weights;
+      for (size_t c = 0; c < _row; c++)
+        weights.push_back(weight(j, c));
+      weights.push_back(_bias[j]);
+      net.back()[j].weights(weights);
+    }
+  }
+};
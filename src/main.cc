@@ -1,13 +1,17 @@
 #include <algorithm>
+#include <chrono>
 #include <iomanip>
 #include <iostream>
 #include <map>
 #include <numeric>
 #include <random>
+#include <set>
 #include <vector>
 
 #include <boost/program_options.hpp>
 
+#include <sys/resource.h>
+
 #include <crypto++/cryptlib.h>
 #include <crypto++/modes.h>
 #include <crypto++/osrng.h>
@@ -17,6 +21,8 @@
 
 #include "base64.h"
 #include "bpnn.h"
+#include "fixed_bpnn.h"
+#include "tiled.h"
 // #include "compression.h"
 #include "types.h"
 #include "util.h"
@@ -43,39 +49,59 @@ private:
   vector<uint8_t>* _out;
 };
 
+class OstreamSink : public Bufferless<Sink>
+{
+public:
+  OstreamSink(ostream& out) : _out(&out) {}
+
+  size_t Put2(const byte* inString, size_t length, int /*messageEnd*/, bool /*blocking*/)
+  {
+    _out->write(reinterpret_cast<const char*>(inString), length);
+    return 0;
+  }
+
+private:
+  ostream* _out;
+};
+
 static void help(const po::options_description& desc)
 {
   string msg = "mlsteg - hide messages in neural network weights";
   cout << msg << endl << desc << endl;
 }
 
-void encrypt(const string& password, const string& data, vector<u8>& dest)
+SecByteBlock derive_key(const string& password)
 {
-  cerr << "[*] Encrypting data..." << endl;
-  char purpose = 0;
+  char purpose = 0; // unused by Crypto++
+
+  // 32 bytes of derived material. Used to key the cipher.
+  // 16 bytes are for the key, and 16 bytes are for the iv.
   SecByteBlock derived(32);
 
   PKCS5_PBKDF2_HMAC<SHA256> pbkdf;
   pbkdf.DeriveKey(derived, sizeof(derived), purpose, (byte*) password.data(), password.size(), NULL, 0, 1024,
                   0.0f);
-  vector<u8> data_vec(data.begin(), data.end());
+  return derived;
+}
+
+void encrypt(const string& password, const u8* data, size_t size, vector<u8>& dest)
+{
+  cerr << "[*] Encrypting data..." << endl;
+  SecByteBlock derived = derive_key(password);
 
   try {
     CBC_Mode<AES>::Encryption e;
     e.SetKeyWithIV(derived.data(), 16, derived.data() + 16, 16);
     //       string s(plaintext.begin(), plaintext.end())
-    StringSource ss(string(data_vec.begin(), data_vec.end()), true,
-                    new StreamTransformationFilter(e, new VectorSink(dest)));
+    StringSource ss(data, size, true, new StreamTransformationFilter(e, new VectorSink(dest)));
   } catch (const Exception& e) {
     cerr << e.what() << endl;
     exit(1);
   }
 }
 
-void dump_network(bpnn<float>& nn, const string& encoded, const string& output_file)
+Json::Value encode_network(bpnn<float>& nn, size_t outputs, const string& weights_file = "")
 {
-  Json::StreamWriterBuilder builder;
-  const unique_ptr<Json::StreamWriter> writer(builder.newStreamWriter());
   Json::Value network;
   Json::Value layers(Json::arrayValue);
   for (auto& layer : nn.net()) {
@@ -93,9 +119,26 @@ void dump_network(bpnn<float>& nn, const string& encoded, const string& output_f
   }
 
   network["layers"] = layers;
-  network["outputs"] = (unsigned) encoded.length();
+  network["outputs"] = (unsigned) outputs;
   network["activation"] = "tanh";
   network["derivative"] = "sech";
+  // Tiled networks keep the output layer in a raw weight file next to the JSON
+  if (weights_file != "")
+    network["weights_file"] = weights_file;
+  // Sparse output layers are rewired from their seed on load
+  if (nn.sparse()) {
+    network["sparse"]["connections"] = (unsigned) nn.sparse();
+    network["sparse"]["seed"] = nn.seed();
+  }
+  return network;
+}
+
+void dump_network(bpnn<float>& nn, const string& encoded, const string& output_file,
+                  const string& weights_file = "")
+{
+  Json::StreamWriterBuilder builder;
+  const unique_ptr<Json::StreamWriter> writer(builder.newStreamWriter());
+  Json::Value network = encode_network(nn, encoded.length(), weights_file);
 
   if (output_file != "") {
     ofstream ofs(output_file);
@@ -135,30 +178,197 @@ void dump_magic_inputs(const vector<float>& inputs)
   ofs.close();
 }
 
+// How steg_data fits the network to the payload
+struct train_options {
+  size_t tile_budget = 0;   // bytes of output layer mapped at once, 0 keeps the network in memory
+  bool closed_form = false; // solve the output layer analytically, SGD is only a fallback
+  float ridge = 0;          // damping of the closed-form solution
+  bool active_set = false;  // skip output neurons that already decode within margin
+  float margin = 0.002;
+  size_t sparse = 0;        // inputs per output neuron, 0 for a dense output layer
+  string template_dir = ""; // cache of hidden stack templates, see load_template
+  size_t fine_tune = 0;     // iterations of full training before fitting a templated output layer
+};
+
+// Reject option combinations steg_data can't train for a network of shape
+static void check_train_options(const train_options& opts, const vector<size_t>& shape)
+{
+  // Outputs are read back rounded to hundredths, so only outputs within half a step of their target are
+  // sure to decode and may be left out of the active set
+  if (!(opts.margin > 0 && opts.margin < 0.005)) {
+    cerr << "ERROR: Margin must be greater than 0 and below 0.005" << endl;
+    exit(ERROR_IN_COMMAND_LINE);
+  }
+  if (opts.tile_budget && opts.sparse) {
+    cerr << "ERROR: Sparse output layers can't be tiled" << endl;
+    exit(ERROR_IN_COMMAND_LINE);
+  }
+  if (opts.sparse > shape[shape.size() - 2]) {
+    cerr << "ERROR: Sparse connections can't exceed the " << shape[shape.size() - 2] << " hidden units"
+         << endl;
+    exit(ERROR_IN_COMMAND_LINE);
+  }
+  if (opts.sparse && shape[shape.size() - 2] > max_sparse_inputs) {
+    cerr << "ERROR: Sparse output layers can't be wired into more than " << max_sparse_inputs
+         << " hidden units" << endl;
+    exit(ERROR_IN_COMMAND_LINE);
+  }
+}
+
+// Template file for the hidden stack of shape (inputs followed by hidden layer widths) in dir
+static string template_path(const string& dir, const vector<size_t>& shape)
+{
+  string key;
+  for (size_t width : shape)
+    key += (key.empty() ? "" : "-") + to_string(width);
+  return dir + "/" + key + ".json";
+}
+
+bpnn<float> decode_network(const Json::Value& network);
+
+// Load the hidden stack and magic inputs cached for shape, if there is a template for it. Templates are
+// written by save_template after a job decodes, in the network JSON format plus an "inputs" array.
+static bool load_template(const string& dir, const vector<size_t>& shape, unique_ptr<bpnn<float>>& hidden,
+                          vector<float>& inputs)
+{
+  string path = template_path(dir, shape);
+  if (dir == "" || !file_exists(path))
+    return false;
+  Json::Value network;
+  Json::Reader reader;
+  if (!reader.parse(read_file(path), network) || network["inputs"].size() != shape[0]) {
+    cerr << "ERROR: Invalid template '" << path << "'" << endl;
+    exit(ERROR_INVALID_JSON);
+  }
+  hidden.reset(new bpnn<float>(decode_network(network)));
+  if (hidden->shape() != shape) {
+    cerr << "ERROR: Template '" << path << "' does not match network topology" << endl;
+    exit(ERROR_INVALID_JSON);
+  }
+  inputs.clear();
+  for (auto& input : network["inputs"])
+    inputs.push_back(input.asFloat());
+  cerr << "[*] Using template " << path << endl;
+  return true;
+}
+
+// Cache the hidden stack (every layer below the output layer) and the magic inputs it was trained with as
+// the template for its shape, unless another job already has. The template is written to a temporary file
+// and renamed into place, so jobs running at the same time never see it half written.
+static void save_template(const string& dir, const vector<vector<perceptron<float>>>& stack,
+                          const vector<float>& inputs)
+{
+  bpnn<float> hidden(stack);
+  string path = template_path(dir, hidden.shape());
+  if (file_exists(path))
+    return;
+  Json::Value network = encode_network(hidden, hidden.net().back().size());
+  for (float input : inputs)
+    network["inputs"].append(input);
+
+  Json::StreamWriterBuilder builder;
+  const unique_ptr<Json::StreamWriter> writer(builder.newStreamWriter());
+  mkdir(dir.c_str(), 0755);
+  string temp_path = path + ".XXXXXX";
+  int fd = mkstemp(&temp_path[0]);
+  if (fd < 0) {
+    cerr << "[!] Could not write template '" << path << "'" << endl;
+    return;
+  }
+  fchmod(fd, 0644);
+  close(fd);
+  ofstream ofs(temp_path);
+  writer->write(network, &ofs);
+  ofs.close();
+  if (!ofs || rename(temp_path.c_str(), path.c_str()) != 0) {
+    cerr << "[!] Could not write template '" << path << "'" << endl;
+    unlink(temp_path.c_str());
+    return;
+  }
+  cerr << "[*] Saved template " << path << endl;
+}
+
+// True if every output quantizes to the same mapping level as its expected value
+static bool decodes(const vector<float>& outputs, const vector<float>& expected)
+{
+  for (size_t i = 0; i < outputs.size(); i++)
+    if ((int) (outputs[i] * 100 + .5) != (int) (expected[i] * 100 + .5))
+      return false;
+  return true;
+}
+
+// Train nn on the samples, running it through the compile-time specialization of steg_data's hidden stack
+// when its shape matches and through the generic bpnn otherwise
+static void train_network(bpnn<float>& nn, const vector<vector<float>>& samples,
+                          const vector<vector<float>>& expected, const train_options& opts,
+                          size_t iterations = 10000, float lrate = 0.01)
+{
+  if (fixed_bpnn<float, 16, 10, 24>::matches(nn)) {
+    fixed_bpnn<float, 16, 10, 24> fixed(nn);
+    if (opts.active_set)
+      fixed.train_active(samples, expected, iterations, lrate, opts.margin);
+    else
+      fixed.train(samples, expected, iterations, lrate);
+    fixed.memory().report(cerr);
+    fixed.store(nn);
+  } else if (opts.active_set) {
+    nn.train_active(samples, expected, iterations, lrate, opts.margin);
+  } else {
+    nn.train(samples, expected, iterations, lrate);
+  }
+}
+
+// Train the hidden stack in memory and the output layer tile by tile from its weight file. With frozen set
+// the hidden stack (e.g. from a template) is left as it is and only the output layer trains, skipping
+// outputs within margin and stopping once they all are, like bpnn::train_active.
+static void train_tiled(bpnn<float>& hidden, tiled_layer<float>& outputs, const vector<float>& inputs,
+                        const vector<float>& expected, size_t iterations = 10000, float lrate = 0.01,
+                        bool frozen = false, float margin = 0.002)
+{
+  cerr << "[*] Tiled training: " << outputs.outputs() << " outputs, " << outputs.tile() << " per tile"
+       << endl;
+  vector<float> x = hidden.forward(inputs);
+  for (size_t iter = 0; iter < iterations; iter++) {
+    vector<float> errors(x.size(), 0);
+    size_t num_active = 0;
+    float sum_error = outputs.train_one(x, expected, lrate, errors, frozen ? margin : 0, &num_active);
+    cout << ">iter=" << iter << ", lrate=" << fixed << setprecision(3) << lrate << ", error=" << fixed
+         << setprecision(3) << sum_error;
+    if (frozen) {
+      cout << ", active=" << num_active << (iter % 1000 ? "\r" : "\n");
+      if (!num_active)
+        break;
+      continue;
+    }
+    cout << "\r";
+    hidden.backward_errors(errors);
+    hidden.update_weights(inputs, lrate);
+    x = hidden.forward(inputs);
+  }
+  cout << endl;
+}
+
 static void steg_data(const string& password, const string& input_file, const string& output_file,
-                      __attribute__((unused)) bool disable_compression)
+                      __attribute__((unused)) bool disable_compression, const train_options& opts)
 {
-  string data;
   stringstream ss;
   vector<u8> compressed;
   vector<u8> encrypted;
 
-  if (input_file != "") {
-    if (file_exists(input_file)) {
-      string pre = "[*] File size: ";
-      string post = " bytes";
-      cerr << pre << file_size(input_file.c_str()) << post << endl;
-      data = read_file(input_file);
-    } else {
-      string pre = "ERROR: File '";
-      string post = "' does not exist.\n";
-      cerr << pre << input_file << post;
-      exit(ERROR_IN_COMMAND_LINE);
-    }
-  } else {
+  // Payload is mapped (or streamed from stdin with "-") once and read in place from here on
+  if (input_file == "") {
     cerr << "ERROR: Need input file for network JSON" << endl;
     exit(ERROR_IN_COMMAND_LINE);
+  } else if (input_file != "-" && !file_exists(input_file)) {
+    string pre = "ERROR: File '";
+    string post = "' does not exist.\n";
+    cerr << pre << input_file << post;
+    exit(ERROR_IN_COMMAND_LINE);
   }
+  input_view data(input_file);
+  string pre = "[*] File size: ";
+  string post = " bytes";
+  cerr << pre << data.size() << post << endl;
 
   //   if (!disable_compression) {
   //     string compressing = "[*] Compressing...";
@@ -168,7 +378,7 @@ static void steg_data(const string& password, const string& input_file, const st
   //   }
 
   if (password != "") {
-    encrypt(password, data, encrypted);
+    encrypt(password, data.data(), data.size(), encrypted);
   }
 
   string encoding = "[*] Encoding network...";
@@ -177,7 +387,7 @@ static void steg_data(const string& password, const string& input_file, const st
   b64 base64;
   cerr << encoding << endl;
   string encoded =
-      password != "" ? base64.encode(encrypted) : base64.encode(vector<u8>(data.begin(), data.end()));
+      password != "" ? base64.encode(encrypted) : base64.encode(data.data(), data.size());
   //           : base64.encode((disable_compression ? vector<u8>(data.begin(), data.end()) : compressed));
   string alphabet = base64.idx();
   random_shuffle(alphabet.begin(), alphabet.end());
@@ -197,56 +407,320 @@ static void steg_data(const string& password, const string& input_file, const st
   // Shape of the neural net
   vector<size_t> shape = {16, 10, 24, encoded.length()};
 
-  // Create magic inputs
+  // Create magic inputs, or take them with the hidden stack from the template for this shape
   static default_random_engine gen;
   static uniform_real_distribution<float> dis(0, 1);
   vector<float> inputs(shape[0]);
   for (size_t i = 0; i < inputs.size(); i++)
     inputs[i] = dis(gen);
+  vector<size_t> hidden_shape(shape.begin(), shape.end() - 1);
+  unique_ptr<bpnn<float>> warm;
+  bool templated = load_template(opts.template_dir, hidden_shape, warm, inputs);
   dump_magic_inputs(inputs);
 
   // Create sample data
   vector<vector<float>> samples = {inputs};
   vector<vector<float>> sample_expected = {expected};
 
+  check_train_options(opts, shape);
+
+  // Tiled mode streams the output layer from disk so its size isn't bounded by RAM
+  if (opts.tile_budget) {
+    string weights_file = (output_file != "" ? output_file : "network") + ".weights";
+    bpnn<float> hidden = templated ? *warm : bpnn<float>(hidden_shape);
+    tiled_layer<float> outputs(weights_file, shape.back(), shape[shape.size() - 2], opts.tile_budget, true);
+    if (templated && opts.fine_tune)
+      train_tiled(hidden, outputs, inputs, expected, opts.fine_tune);
+    bool solved = false;
+    if (opts.closed_form) {
+      cerr << "[*] Solving output layer..." << endl;
+      vector<float> x = hidden.forward(inputs);
+      outputs.solve(x, expected, opts.ridge);
+      vector<float> outs(expected.size());
+      outputs.forward(x, [&](size_t idx, float f) { outs[idx] = f; });
+      if (!(solved = decodes(outs, expected)))
+        cerr << "[!] Closed-form solution doesn't decode, falling back to SGD" << endl;
+    }
+    if (!solved)
+      train_tiled(hidden, outputs, inputs, expected, 10000, 0.01, templated, opts.margin);
+    if (opts.template_dir != "" && !templated) {
+      vector<float> outs(expected.size());
+      outputs.forward(hidden.forward(inputs), [&](size_t idx, float f) { outs[idx] = f; });
+      if (decodes(outs, expected))
+        save_template(opts.template_dir, hidden.net(), inputs);
+    }
+    // The network names its weight file relative to itself, see resolve_weights_file
+    dump_network(hidden, encoded, output_file, weights_file.substr(weights_file.rfind('/') + 1));
+    return;
+  }
+
+  bpnn<float> nn(shape, opts.sparse, random_device()());
+  train_options output_opts = opts;
+  if (templated) {
+    copy(warm->net().begin(), warm->net().end(), nn.net().begin());
+    if (opts.fine_tune)
+      train_network(nn, samples, sample_expected, opts, opts.fine_tune);
+    // With the hidden stack fixed, settled outputs stay settled, so the active set can stop training as
+    // soon as the output layer fits
+    nn.freeze_hidden(true);
+    output_opts.active_set = true;
+  }
+  bool solved = false;
+  if (opts.closed_form) {
+    cerr << "[*] Solving output layer..." << endl;
+    nn.solve_output_layer(inputs, expected, opts.ridge);
+    if (!(solved = decodes(nn.forward(inputs), expected)))
+      cerr << "[!] Closed-form solution doesn't decode, falling back to SGD" << endl;
+  }
+
   // Train magic input sample to expected data
-  bpnn<float> nn(shape);
-  nn.train(samples, sample_expected, 10000);
+  if (!solved)
+    train_network(nn, samples, sample_expected, output_opts);
+  if (opts.template_dir != "" && !templated && decodes(nn.forward(inputs), expected))
+    save_template(opts.template_dir, {nn.net().begin(), nn.net().end() - 1}, inputs);
   dump_network(nn, encoded, output_file);
 }
 
-bpnn<float> decode_network(const string& data)
+// Heap bytes of a vector grown to n elements by push_back, allocator overhead included
+static size_t pushed_back_bytes(size_t n, size_t element_size)
 {
-  Json::Value network;
-  Json::Reader reader;
-  size_t num_outputs = 0;
-  vector<vector<perceptron<float>>> net;
-  if (reader.parse(data, network)) {
-    num_outputs = network["outputs"].asLargestInt();
-    for (auto& layer : network["layers"]) {
-      vector<perceptron<float>> l;
-      for (auto& neuron : layer) {
-        vector<float> w;
-        for (auto& weight : neuron["weights"])
-          w.push_back(weight.asFloat());
-        perceptron<float> p(w.size() - 1);
-        p.weights(w);
-        l.push_back(p);
-      }
-      net.push_back(l);
+  size_t capacity = 1;
+  while (capacity < n)
+    capacity <<= 1;
+  return capacity * element_size + 16;
+}
+
+// Average seconds per call of step, repeated for at least 100ms
+template<typename F> static double seconds_per_call(F step)
+{
+  size_t calls = 0;
+  double elapsed = 0;
+  auto start = chrono::steady_clock::now();
+  do {
+    step();
+    calls++;
+    elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  } while (elapsed < 0.1 || calls < 3);
+  return elapsed / calls;
+}
+
+// Estimate what steg_data would produce and cost for this payload and settings, without training, and
+// print it as JSON. Sizes follow steg_data's pipeline and data structures; timings come from running the
+// kernels steg_data would pick on a slice of the output layer and scaling to its full width.
+static void plan_steg(const string& password, const string& input_file,
+                      __attribute__((unused)) bool disable_compression, const train_options& opts)
+{
+  const size_t iterations = 10000;
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  size_t baseline = usage.ru_maxrss * 1024;
+
+  size_t payload = 0;
+  if (input_file == "-") {
+    payload = input_view(input_file).size();
+  } else if (input_file != "" && file_exists(input_file)) {
+    payload = file_size(input_file.c_str());
+  } else {
+    cerr << "ERROR: Need an existing input file to plan for" << endl;
+    exit(ERROR_IN_COMMAND_LINE);
+  }
+
+  // Payload through encryption (PKCS padded CBC) and unpadded base64
+  size_t encrypted = password != "" ? (payload / 16 + 1) * 16 : payload;
+  size_t chars = encrypted / 3 * 4 + (encrypted % 3 ? encrypted % 3 + 1 : 0);
+  vector<size_t> shape = {16, 10, 24, chars};
+  check_train_options(opts, shape);
+  size_t hidden_units = shape[shape.size() - 2];
+  size_t weights_per_output = (opts.sparse ? opts.sparse : hidden_units) + 1;
+  size_t hidden_weights = 0, hidden_neurons = 0;
+  for (size_t layer = 0; layer + 2 < shape.size(); layer++) {
+    hidden_weights += (shape[layer] + 1) * shape[layer + 1];
+    hidden_neurons += shape[layer + 1];
+  }
+  size_t output_weights = chars * weights_per_output;
+
+  // Calibrate on the planned hidden stack with a slice of the output layer
+  size_t cal_outputs = max<size_t>(1, min<size_t>(chars, 4096));
+  double scale = (double) chars / cal_outputs;
+  vector<size_t> cal_shape = {16, 10, 24, cal_outputs};
+  vector<size_t> hidden_shape(cal_shape.begin(), cal_shape.end() - 1);
+  bpnn<float> cal(cal_shape, opts.sparse, 0);
+  bpnn<float> hidden(hidden_shape);
+  vector<float> inputs(cal_shape[0], 0.5), expected(cal_outputs, 0.3);
+  string kernel;
+  double iteration_seconds = 0, solve_seconds = 0;
+  if (opts.tile_budget) {
+    kernel = "tiled";
+    char weights_file[] = "/tmp/mlsteg-plan-XXXXXX";
+    close(mkstemp(weights_file));
+    {
+      tiled_layer<float> layer(weights_file, cal_outputs, hidden_units, opts.tile_budget, true);
+      iteration_seconds = seconds_per_call([&]() {
+        vector<float> x = hidden.forward(inputs);
+        vector<float> errors(x.size(), 0);
+        layer.train_one(x, expected, 0.01, errors);
+        hidden.backward_errors(errors);
+        hidden.update_weights(inputs, 0.01);
+      });
+      solve_seconds = seconds_per_call([&]() { layer.solve(hidden.forward(inputs), expected, opts.ridge); });
     }
+    unlink(weights_file);
+  } else if (fixed_bpnn<float, 16, 10, 24>::matches(cal)) {
+    kernel = "fixed_bpnn";
+    fixed_bpnn<float, 16, 10, 24> fixed(cal);
+    iteration_seconds = seconds_per_call([&]() { fixed.train_one(inputs, expected, 0.01); });
+  } else {
+    kernel = "bpnn";
+    iteration_seconds = seconds_per_call([&]() { cal.train_one(inputs, expected, 0.01); });
+  }
+  if (!opts.tile_budget)
+    solve_seconds = seconds_per_call([&]() { cal.solve_output_layer(inputs, expected, opts.ridge); });
+
+  // File sizes: serialize the calibration network and the bare hidden stack with the real writer
+  Json::StreamWriterBuilder builder;
+  const unique_ptr<Json::StreamWriter> writer(builder.newStreamWriter());
+  auto json_bytes = [&](bpnn<float>& nn, size_t outputs, const string& weights_file) {
+    ostringstream os;
+    writer->write(encode_network(nn, outputs, weights_file), &os);
+    return (double) os.str().size();
+  };
+  double hidden_json = json_bytes(hidden, chars, "");
+  size_t json_file = hidden_json + (json_bytes(cal, chars, "") - hidden_json) * scale;
+  size_t tiled_json = json_bytes(hidden, chars, "network.weights");
+  size_t tiled_weights = chars * (hidden_units + 1) * sizeof(float);
+
+  // Peak RSS: payload stages and targets (expected plus its copy as a sample), then the network, which
+  // peaks either while fixed_bpnn holds its copy or while dump_network holds two JSON trees
+  size_t pipeline = payload + (password != "" ? encrypted : 0) + chars + 2 * chars * sizeof(float);
+  size_t json_node = sizeof(Json::Value::ObjectValues::value_type) + 48;
+  size_t peak = baseline + pipeline;
+  if (opts.tile_budget) {
+    size_t row = (hidden_units + 1) * sizeof(float);
+    size_t tile = max<size_t>(1, opts.tile_budget / row) * row;
+    peak += hidden_neurons * (sizeof(perceptron<float>) + pushed_back_bytes(shape[0] + 1, sizeof(float))) +
+            min(tiled_weights, tile);
   } else {
+    size_t neuron = sizeof(perceptron<float>) + pushed_back_bytes(weights_per_output, sizeof(float));
+    // Sparse wiring is one byte per connection, kept by the bpnn rather than its neurons
+    size_t network = (hidden_neurons + chars) * neuron + chars * opts.sparse;
+    size_t training =
+        kernel == "fixed_bpnn" ? fixed_bpnn<float, 16, 10, 24>::arena_bytes(chars, opts.sparse) : 0;
+    size_t json_tree = 2 * (hidden_neurons + chars) * (weights_per_output + 2) * json_node;
+    peak += network + max(training, json_tree);
+  }
+
+  Json::Value plan;
+  plan["payload"]["bytes"] = (Json::UInt64) payload;
+  plan["payload"]["compressed"] = false; // steg_data doesn't compress yet
+  plan["payload"]["encrypted_bytes"] = (Json::UInt64) encrypted;
+  plan["payload"]["encoded_chars"] = (Json::UInt64) chars;
+  for (size_t width : shape)
+    plan["network"]["topology"].append((Json::UInt64) width);
+  plan["network"]["output_neurons"] = (Json::UInt64) chars;
+  plan["network"]["sparse"] = (Json::UInt64) opts.sparse;
+  plan["network"]["hidden_weights"] = (Json::UInt64) hidden_weights;
+  plan["network"]["output_weights"] = (Json::UInt64) output_weights;
+  plan["network"]["weights"] = (Json::UInt64) (hidden_weights + output_weights);
+  plan["memory"]["peak_rss_bytes"] = (Json::UInt64) peak;
+  plan["memory"]["tile_budget_bytes"] = (Json::UInt64) opts.tile_budget;
+  if (kernel == "fixed_bpnn")
+    plan["memory"]["arena_bytes"] =
+        (Json::UInt64) fixed_bpnn<float, 16, 10, 24>::arena_bytes(chars, opts.sparse);
+  plan["files"]["json"] = (Json::UInt64) json_file;
+  if (!opts.sparse) {
+    plan["files"]["tiled"]["json"] = (Json::UInt64) tiled_json;
+    plan["files"]["tiled"]["weights"] = (Json::UInt64) tiled_weights;
+  }
+  plan["training"]["kernel"] = kernel;
+  plan["training"]["calibration_outputs"] = (Json::UInt64) cal_outputs;
+  plan["training"]["seconds_per_iteration"] = iteration_seconds * scale;
+  plan["training"]["iterations"] = (Json::UInt64) iterations;
+  // Active-set training usually stops long before the last iteration, so this is an upper bound there
+  plan["training"]["estimated_seconds"] = iteration_seconds * scale * iterations;
+  if (opts.closed_form)
+    plan["training"]["closed_form_seconds"] = solve_seconds * scale;
+  writer->write(plan, &cout);
+  cout << endl;
+}
+
+Json::Value parse_network(const string& data)
+{
+  Json::Value network;
+  Json::Reader reader;
+  if (!reader.parse(data, network)) {
     cerr << "ERROR: Invalid network JSON file" << endl;
     exit(ERROR_INVALID_JSON);
   }
+  return network;
+}
+
+// Tiled networks name their weight file relative to the network JSON, point it at the file from the
+// current directory. Absolute names are kept, and so are names written relative to the directory steg
+// ran in by older versions when that is the only place they resolve.
+static void resolve_weights_file(Json::Value& network, const string& network_file)
+{
+  if (!network.isMember("weights_file"))
+    return;
+  string name = network["weights_file"].asString();
+  size_t slash = network_file.rfind('/');
+  if (name.empty() || name[0] == '/' || slash == string::npos)
+    return;
+  string path = network_file.substr(0, slash + 1) + name;
+  if (file_exists(path) || !file_exists(name))
+    network["weights_file"] = path;
+}
+
+// Why network can't be decoded by decode_network, or "" if it can
+static string network_error(const Json::Value& network)
+{
+  const Json::Value& layers = network["layers"];
+  if (!layers.isArray() || layers.empty())
+    return "Invalid network JSON file";
+  for (auto& layer : layers) {
+    if (!layer.isArray() || layer.empty())
+      return "Invalid network JSON file";
+    for (auto& neuron : layer)
+      if (!neuron.isObject() || !neuron["weights"].isArray() || neuron["weights"].empty())
+        return "Invalid network JSON file";
+  }
+  if (network.isMember("sparse")) {
+    size_t k = network["sparse"]["connections"].asLargestUInt();
+    const Json::Value& last = layers[layers.size() - 1];
+    size_t num_inputs = layers.size() > 1 ? layers[layers.size() - 2].size() : last[0]["weights"].size() - 1;
+    for (auto& neuron : last)
+      if (!k || k > num_inputs || num_inputs > max_sparse_inputs || neuron["weights"].size() != k + 1)
+        return "Invalid sparse network";
+  }
+  return "";
+}
+
+bpnn<float> decode_network(const Json::Value& network)
+{
+  string error = network_error(network);
+  if (error != "") {
+    cerr << "ERROR: " << error << endl;
+    exit(ERROR_INVALID_JSON);
+  }
+
+  vector<vector<perceptron<float>>> net;
+  for (auto& layer : network["layers"]) {
+    vector<perceptron<float>> l;
+    for (auto& neuron : layer) {
+      vector<float> w;
+      for (auto& weight : neuron["weights"])
+        w.push_back(weight.asFloat());
+      l.push_back(perceptron<float>(w));
+    }
+    net.push_back(l);
+  }
 
   // build network
-  vector<size_t> shape;
-  for (size_t i = 0; i < net.size(); i++)
-    shape.push_back(net[i].size());
-  shape.push_back(num_outputs);
-  bpnn<float> nn(shape);
-  nn.net(net);
+  bpnn<float> nn(net);
+  if (network.isMember("sparse")) {
+    size_t num_inputs = net.size() > 1 ? net[net.size() - 2].size() : nn.shape()[0];
+    nn.connect_output_layer(num_inputs, network["sparse"]["connections"].asLargestUInt(),
+                            network["sparse"]["seed"].asUInt());
+  }
   return nn;
 }
 
@@ -293,34 +767,187 @@ map<float, char> read_mapping(const string& mapping_file)
   return mapping;
 }
 
+// Decrypt data with the derived key, leaving Crypto++ errors (e.g. bad padding from a wrong password) to
+// the caller
+static void decrypt_or_throw(const string& data, vector<u8>& dest, const SecByteBlock& derived)
+{
+  CBC_Mode<AES>::Decryption d;
+  d.SetKeyWithIV(derived.data(), 16, derived.data() + 16, 16);
+  StringSource ss(data, true, new StreamTransformationFilter(d, new VectorSink(dest)));
+}
+
+void decrypt(const string& data, vector<u8>& dest, const SecByteBlock& derived)
+{
+  try {
+    decrypt_or_throw(data, dest, derived);
+  } catch (const Exception& e) {
+    cerr << e.what() << endl;
+    exit(1);
+  }
+}
+
 void decrypt(const string& data, vector<u8>& dest, const string& password)
 {
   string decoding = "[*] Decrypting data...";
   cerr << decoding << endl;
-  char purpose = 0; // unused by Crypto++
+  decrypt(data, dest, derive_key(password));
+}
 
-  // 32 bytes of derived material. Used to key the cipher.
-  // 16 bytes are for the key, and 16 bytes are for the iv.
-  SecByteBlock derived(32);
+// Map a network output back to its character, or 0 if it doesn't land on a mapped level
+static char decode_output(float f, const map<float, char>& mapping)
+{
+  int round = f * 100 + .5;
+  auto it = mapping.find(round);
+  return it != mapping.end() ? it->second : 0;
+}
 
-  PKCS5_PBKDF2_HMAC<SHA256> pbkdf;
-  pbkdf.DeriveKey(derived, sizeof(derived), purpose, (byte*) password.data(), password.size(), NULL, 0, 1024,
-                  0.0f);
+// Unsteg a network whose output layer lives in a weight file. Outputs are evaluated tile by tile and the
+// characters streamed through base64 decoding and decryption, so the output layer is never held in RAM.
+static void unsteg_tiled(const string& password, const Json::Value& network, bpnn<float>& hidden,
+                         const vector<float>& inputs, const map<float, char>& mapping,
+                         const string& output_file, size_t tile_budget)
+{
+  vector<float> x = hidden.forward(inputs);
+  size_t num_outputs = network["outputs"].asLargestUInt();
+  tiled_layer<float> outputs(network["weights_file"].asString(), num_outputs, x.size(), tile_budget, false);
+
+  ofstream ofs;
+  if (output_file != "")
+    ofs.open(output_file, ios_base::out | ios_base::binary);
+  ostream& out = output_file != "" ? ofs : cout;
+  if (output_file == "")
+    cerr << endl << "<<< BEGIN RECOVERED MESSAGE >>>" << endl << endl;
 
   try {
     CBC_Mode<AES>::Decryption d;
-    d.SetKeyWithIV(derived.data(), 16, derived.data() + 16, 16);
-    StringSource ss(data, true, new StreamTransformationFilter(d, new VectorSink(dest)));
+    unique_ptr<StreamTransformationFilter> filter;
+    if (password != "") {
+      cerr << "[*] Decrypting data..." << endl;
+      SecByteBlock derived = derive_key(password);
+      d.SetKeyWithIV(derived.data(), 16, derived.data() + 16, 16);
+      filter.reset(new StreamTransformationFilter(d, new OstreamSink(out)));
+    }
+
+    // Base64 decode whole quads as they arrive
+    b64 base64;
+    string chunk;
+    auto flush = [&]() {
+      string decoded = base64.decode(chunk);
+      if (filter)
+        filter->Put(reinterpret_cast<const byte*>(decoded.data()), decoded.size());
+      else
+        out.write(decoded.data(), decoded.size());
+      chunk.clear();
+    };
+
+    outputs.forward(x, [&](size_t, float f) {
+      if (char c = decode_output(f, mapping))
+        chunk += c;
+      if (chunk.size() == 4096)
+        flush();
+    });
+    flush();
+    if (filter)
+      filter->MessageEnd();
   } catch (const Exception& e) {
     cerr << e.what() << endl;
     exit(1);
   }
+
+  if (output_file == "")
+    cerr << endl << "<<< END RECOVERED MESSAGE >>>" << endl;
+}
+
+// Recover only bytes [offset, offset + length) of the payload. Just the output neurons holding the
+// base64 quads of those bytes are evaluated (only their tiles are mapped for tiled networks), and with a
+// password only the CBC blocks covering the range are decrypted, keyed with the preceding ciphertext
+// block as IV.
+static void unsteg_range(const string& password, const Json::Value& network, bpnn<float>& nn,
+                         const vector<float>& inputs, const map<float, char>& mapping,
+                         const string& output_file, size_t offset, size_t length, size_t tile_budget)
+{
+  const size_t block = 16;
+  size_t num_outputs = network["outputs"].asLargestUInt();
+  size_t encoded_len = num_outputs * 3 / 4;
+
+  // Encoded byte range to recover, with its end clamped before adding so huge lengths can't wrap around
+  size_t end = length > encoded_len - min(offset, encoded_len) ? encoded_len : offset + length;
+  size_t first = offset, last = end;
+  if (password != "") {
+    first = offset / block ? (offset / block - 1) * block : 0;
+    last = ((end + block - 1) / block) * block;
+  }
+  last = min(last, encoded_len);
+  first = min(first, last);
+
+  // Output neurons covering the base64 quads of that range
+  size_t first_quad = first / 3, last_quad = (last + 2) / 3;
+  size_t first_output = first_quad * 4, last_output = min(num_outputs, last_quad * 4);
+  string encoded;
+  auto emit = [&](size_t, float f) {
+    if (char c = decode_output(f, mapping))
+      encoded += c;
+  };
+  if (network.isMember("weights_file")) {
+    vector<float> x = nn.forward(inputs);
+    tiled_layer<float> outputs(network["weights_file"].asString(), num_outputs, x.size(),
+                               tile_budget ? tile_budget : 64 << 20, false);
+    outputs.forward(x, first_output, last_output, emit);
+  } else {
+    vector<float> outs = nn.forward_range(inputs, first_output, last_output);
+    for (size_t i = 0; i < outs.size(); i++)
+      emit(first_output + i, outs[i]);
+  }
+
+  b64 base64;
+  string decoded = base64.decode(encoded);
+  size_t skip = first - first_quad * 3;
+  decoded = decoded.substr(min(skip, decoded.size()), last - first);
+
+  vector<u8> recovered(decoded.begin(), decoded.end());
+  size_t start = offset - first;
+  if (password != "") {
+    cerr << "[*] Decrypting data..." << endl;
+    SecByteBlock derived = derive_key(password);
+    bool has_iv_block = offset / block > 0;
+    const byte* iv = has_iv_block ? reinterpret_cast<const byte*>(decoded.data()) : derived.data() + 16;
+    size_t cipher_start = has_iv_block ? block : 0;
+    if (decoded.size() < cipher_start) {
+      cerr << "ERROR: Range is past the end of the payload" << endl;
+      exit(ERROR_IN_COMMAND_LINE);
+    }
+    // Padding only needs stripping when the range reaches the final block
+    auto padding = last == encoded_len ? BlockPaddingSchemeDef::DEFAULT_PADDING
+                                       : BlockPaddingSchemeDef::NO_PADDING;
+    recovered.clear();
+    try {
+      CBC_Mode<AES>::Decryption d;
+      d.SetKeyWithIV(derived.data(), 16, iv, 16);
+      const byte* cipher = reinterpret_cast<const byte*>(decoded.data()) + cipher_start;
+      StringSource ss(cipher, decoded.size() - cipher_start, true,
+                      new StreamTransformationFilter(d, new VectorSink(recovered), padding));
+    } catch (const Exception& e) {
+      cerr << e.what() << endl;
+      exit(1);
+    }
+    start = offset - (first + cipher_start);
+  }
+  start = min(start, recovered.size());
+  size_t count = min(length, recovered.size() - start);
+
+  if (output_file != "") {
+    ofstream ofs(output_file, ios_base::out | ios_base::binary);
+    ofs.write(reinterpret_cast<const char*>(recovered.data() + start), count);
+  } else {
+    cout.write(reinterpret_cast<const char*>(recovered.data() + start), count);
+  }
 }
 
 static void unsteg_data(const string& password, const string& input_file,
                         const string& magic_inputs_file = "inputs.json",
                         const string& mapping_file = "mappings.json", const string& output_file = "unstegged",
-                        __attribute__((unused)) bool disable_compression = false)
+                        __attribute__((unused)) bool disable_compression = false,
+                        size_t tile_budget = 0, const string& range = "")
 {
   string data = "";
 
@@ -346,25 +973,42 @@ static void unsteg_data(const string& password, const string& input_file,
   // Decode and build network
   string decoding = "[*] Decoding network JSON...";
   cerr << decoding << endl;
-  bpnn<float> nn = decode_network(data);
+  Json::Value network = parse_network(data);
+  resolve_weights_file(network, input_file);
+  bpnn<float> nn = decode_network(network);
 
   // Read magic inputs
   vector<float> inputs = read_inputs(magic_inputs_file);
 
-  // Feed inputs through network
-  vector<float> outputs = nn.forward(inputs);
-
   // Map output to characters (how do we provide to CLI?)
   map<float, char> mapping = read_mapping(mapping_file);
 
+  if (range != "") {
+    size_t offset = 0, length = 0;
+    char sep = 0;
+    stringstream rs(range);
+    // Extracting a size_t accepts (and wraps) negative numbers, so rule them out first
+    if (range.find('-') != string::npos || !(rs >> offset >> sep >> length) || sep != ':' || !rs.eof()) {
+      cerr << "ERROR: Range must be offset:length" << endl;
+      exit(ERROR_IN_COMMAND_LINE);
+    }
+    unsteg_range(password, network, nn, inputs, mapping, output_file, offset, length, tile_budget);
+    return;
+  }
+
+  if (network.isMember("weights_file")) {
+    unsteg_tiled(password, network, nn, inputs, mapping, output_file, tile_budget ? tile_budget : 64 << 20);
+    return;
+  }
+
+  // Feed inputs through network
+  vector<float> outputs = nn.forward(inputs);
+
   // Decode network outputs
   stringstream ss;
-  for (float f : outputs) {
-    int round = f * 100 + .5;
-    for (auto& it : mapping)
-      if (it.first == round)
-        ss << it.second;
-  }
+  for (float f : outputs)
+    if (char c = decode_output(f, mapping))
+      ss << c;
 
   // B64 decode
   b64 base64;
@@ -413,6 +1057,192 @@ static void unsteg_data(const string& password, const string& input_file,
   }
 }
 
+// One network of a batch unsteg, with the magic inputs and mapping it was stegged with
+struct batch_job {
+  string network_file;
+  string inputs_file;
+  string mapping_file;
+  string output_file;
+  Json::Value network;
+  unique_ptr<bpnn<float>> nn;
+  size_t recovered = 0;
+  string error; // set by the worker that failed on this job, reported from the main thread
+};
+
+// Report the errors batch workers recorded in jobs and exit if there were any. Workers never exit
+// themselves, so every job they could finish is complete when this runs.
+static void check_batch_errors(const vector<batch_job>& jobs, int code)
+{
+  bool failed = false;
+  for (auto& job : jobs) {
+    if (job.error != "") {
+      cerr << "ERROR: " << job.network_file << ": " << job.error << endl;
+      failed = true;
+    }
+  }
+  if (failed)
+    exit(code);
+}
+
+// Shape and raw weights of every layer of nn below the output layer, as a key that is equal for networks
+// sharing the same hidden stack
+static string hidden_stack_key(bpnn<float>& nn)
+{
+  vector<size_t> shape = nn.shape();
+  string key(reinterpret_cast<const char*>(shape.data()), (shape.size() - 1) * sizeof(size_t));
+  for (size_t layer = 0; layer + 1 < nn.net().size(); layer++)
+    for (auto& neuron : nn.net()[layer])
+      for (size_t i = 0; i <= neuron.num_inputs(); i++) {
+        float w = neuron.weight(i);
+        key.append(reinterpret_cast<const char*>(&w), sizeof(w));
+      }
+  return key;
+}
+
+// Unsteg many networks at once. Entries are "network[,inputs,mapping]" and default to the shared magic
+// inputs and mapping files, which are parsed once. Networks are parsed concurrently. In-memory networks
+// with the same magic input values and hidden stack (networks stegged from one template) form a group
+// whose hidden activations are computed once, after which batches of their output layers are evaluated
+// in parallel by forward_output_batch. Each payload is written to <network>.out, inside output_dir when
+// one is given.
+static void unsteg_batch(const string& password, const vector<string>& entries,
+                         const string& magic_inputs_file, const string& mapping_file,
+                         const string& output_dir, size_t tile_budget)
+{
+  auto start = chrono::steady_clock::now();
+  if (output_dir != "" && mkdir(output_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+    cerr << "ERROR: Could not create output directory '" << output_dir << "'" << endl;
+    exit(ERROR_IN_COMMAND_LINE);
+  }
+  vector<batch_job> jobs(entries.size());
+  map<string, vector<float>> inputs;
+  map<string, map<float, char>> mappings;
+  set<string> output_files;
+  for (size_t i = 0; i < entries.size(); i++) {
+    vector<string> fields;
+    stringstream ss(entries[i]);
+    for (string field; getline(ss, field, ',');)
+      fields.push_back(field);
+    if (fields.empty() || fields[0] == "") {
+      cerr << "ERROR: Batch entry '" << entries[i] << "' names no network file" << endl;
+      exit(ERROR_IN_COMMAND_LINE);
+    }
+    batch_job& job = jobs[i];
+    job.network_file = fields[0];
+    job.inputs_file = fields.size() > 1 ? fields[1] : magic_inputs_file;
+    job.mapping_file = fields.size() > 2 ? fields[2] : mapping_file;
+    string name = job.network_file.substr(job.network_file.find_last_of('/') + 1);
+    job.output_file = (output_dir != "" ? output_dir + "/" + name : job.network_file) + ".out";
+    // Jobs run in parallel, so two of them writing one file would silently lose a payload
+    if (!output_files.insert(job.output_file).second) {
+      cerr << "ERROR: More than one network would be unstegged to '" << job.output_file << "'" << endl;
+      exit(ERROR_IN_COMMAND_LINE);
+    }
+    if (!file_exists(job.network_file)) {
+      cerr << "ERROR: File '" << job.network_file << "' does not exist." << endl;
+      exit(ERROR_IN_COMMAND_LINE);
+    }
+    if (!inputs.count(job.inputs_file))
+      inputs[job.inputs_file] = read_inputs(job.inputs_file);
+    if (!mappings.count(job.mapping_file))
+      mappings[job.mapping_file] = read_mapping(job.mapping_file);
+  }
+
+  cerr << "[*] Decoding " << jobs.size() << " networks..." << endl;
+  parallel_for(jobs.size(), [&](size_t i) {
+    batch_job& job = jobs[i];
+    try {
+      ifstream ifs(job.network_file);
+      Json::Reader reader;
+      if (!ifs.is_open())
+        job.error = "Could not open the file";
+      else if (!reader.parse(string{istreambuf_iterator<char>{ifs}, {}}, job.network))
+        job.error = "Invalid network JSON file";
+      else if ((job.error = network_error(job.network)) == "")
+        job.nn.reset(new bpnn<float>(decode_network(job.network)));
+    } catch (const exception& e) {
+      job.error = e.what();
+    }
+  });
+  check_batch_errors(jobs, ERROR_INVALID_JSON);
+  for (auto& job : jobs)
+    resolve_weights_file(job.network, job.network_file);
+
+  unique_ptr<SecByteBlock> key;
+  if (password != "") {
+    cerr << "[*] Decrypting data..." << endl;
+    key.reset(new SecByteBlock(derive_key(password)));
+  }
+
+  // Group in-memory networks by magic input values and hidden stack; tiled ones are streamed on their own
+  map<pair<vector<float>, string>, vector<batch_job*>> groups;
+  for (auto& job : jobs) {
+    if (job.network.isMember("weights_file")) {
+      unsteg_tiled(password, job.network, *job.nn, inputs.at(job.inputs_file), mappings.at(job.mapping_file),
+                   job.output_file, tile_budget ? tile_budget : 64 << 20);
+      job.recovered = file_size(job.output_file.c_str());
+    } else {
+      groups[{inputs.at(job.inputs_file), hidden_stack_key(*job.nn)}].push_back(&job);
+    }
+  }
+
+  // Hidden activations once per group, then every batch of every group in one parallel pass
+  const size_t batch_size = 8;
+  vector<vector<float>> hidden;
+  vector<pair<size_t, vector<batch_job*>>> batches; // index into hidden and the jobs evaluated on it
+  for (auto& group : groups) {
+    vector<batch_job*>& members = group.second;
+    hidden.push_back(members[0]->nn->forward_hidden(group.first.first));
+    for (size_t first = 0; first < members.size(); first += batch_size) {
+      auto last = members.begin() + min(members.size(), first + batch_size);
+      batches.push_back({hidden.size() - 1, vector<batch_job*>(members.begin() + first, last)});
+    }
+  }
+  parallel_for(batches.size(), [&](size_t batch_idx) {
+    vector<batch_job*>& batch = batches[batch_idx].second;
+    vector<bpnn<float>*> nets;
+    for (auto job : batch)
+      nets.push_back(job->nn.get());
+    vector<vector<float>> outputs = forward_output_batch(nets, hidden[batches[batch_idx].first]);
+
+    for (size_t i = 0; i < batch.size(); i++) {
+      const map<float, char>& mapping = mappings.at(batch[i]->mapping_file);
+      string encoded;
+      for (float f : outputs[i])
+        if (char c = decode_output(f, mapping))
+          encoded += c;
+      b64 base64;
+      string decoded = base64.decode(encoded);
+      vector<u8> recovered(decoded.begin(), decoded.end());
+      try {
+        if (key) {
+          recovered.clear();
+          decrypt_or_throw(decoded, recovered, *key);
+        }
+      } catch (const exception& e) {
+        batch[i]->error = string("Could not decrypt: ") + e.what();
+        continue;
+      }
+      ofstream ofs(batch[i]->output_file, ios_base::out | ios_base::binary);
+      ofs.write(reinterpret_cast<const char*>(recovered.data()), recovered.size());
+      if (!ofs) {
+        batch[i]->error = "Could not write '" + batch[i]->output_file + "'";
+        continue;
+      }
+      batch[i]->recovered = recovered.size();
+    }
+  });
+  check_batch_errors(jobs, EXIT_FAILURE);
+
+  size_t total = 0;
+  for (auto& job : jobs)
+    total += job.recovered;
+  double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  cerr << "[*] Recovered " << jobs.size() << " payloads (" << total << " bytes) in " << fixed
+       << setprecision(3) << seconds << "s: " << setprecision(1) << jobs.size() / seconds << " networks/s, "
+       << total / seconds / (1 << 20) << " MiB/s" << endl;
+}
+
 int main(int argc, char** argv)
 {
   bool unsteg = "";
@@ -422,6 +1252,11 @@ int main(int argc, char** argv)
   string magic_inputs_file = "";
   string mapping_file = "";
   bool disable_compression = false;
+  size_t tile_budget = 0;
+  vector<string> batch;
+  string range = "";
+  bool plan = false;
+  train_options train_opts;
 
   try {
     string options = "mlsteg options";
@@ -434,6 +1269,25 @@ int main(int argc, char** argv)
     string pass_switches = "password,p", pass_message = "encryption password";
     string disable_compression_switches = "disable-compression",
            disable_compression_message = "disable compression";
+    string tile_budget_switches = "tile-budget",
+           tile_budget_message = "train/decode the output layer in tiles of this many MiB (0 = in memory)";
+    string closed_form_switches = "closed-form",
+           closed_form_message = "solve the output layer directly, falling back to training";
+    string ridge_switches = "ridge", ridge_message = "ridge damping for --closed-form";
+    string active_set_switches = "active-set",
+           active_set_message = "only train output neurons that don't decode within --margin yet";
+    string margin_switches = "margin", margin_message = "active set margin, below 0.005 (default 0.002)";
+    string sparse_switches = "sparse",
+           sparse_message = "connect each output neuron to only this many hidden units (0 = dense)";
+    string batch_switches = "batch",
+           batch_message = "unsteg many networks (network[,inputs,mapping] ...) into <network>.out, "
+                           "-o is the output directory";
+    string range_switches = "range", range_message = "only unsteg bytes offset:length of the message";
+    string plan_switches = "plan", plan_message = "print the expected size and cost of stegging as JSON";
+    string template_dir_switches = "template-dir",
+           template_dir_message = "start from the hidden stack cached here for the shape, or cache it";
+    string fine_tune_switches = "fine-tune",
+           fine_tune_message = "iterations of full training before fitting a templated output layer";
 
     po::options_description desc(options);
     // clang-format off
@@ -444,7 +1298,18 @@ int main(int argc, char** argv)
         mapping_file_switches.c_str(), po::value(&mapping_file), mapping_file_message.c_str())(
         output_switches.c_str(), po::value(&output_file), output_message.c_str())(
         pass_switches.c_str(), po::value(&password), pass_message.c_str())(
-        disable_compression_switches.c_str(), po::bool_switch(&disable_compression), disable_compression_message.c_str());
+        disable_compression_switches.c_str(), po::bool_switch(&disable_compression), disable_compression_message.c_str())(
+        tile_budget_switches.c_str(), po::value(&tile_budget), tile_budget_message.c_str())(
+        closed_form_switches.c_str(), po::bool_switch(&train_opts.closed_form), closed_form_message.c_str())(
+        ridge_switches.c_str(), po::value(&train_opts.ridge), ridge_message.c_str())(
+        active_set_switches.c_str(), po::bool_switch(&train_opts.active_set), active_set_message.c_str())(
+        margin_switches.c_str(), po::value(&train_opts.margin), margin_message.c_str())(
+        sparse_switches.c_str(), po::value(&train_opts.sparse), sparse_message.c_str())(
+        batch_switches.c_str(), po::value(&batch)->multitoken(), batch_message.c_str())(
+        range_switches.c_str(), po::value(&range), range_message.c_str())(
+        plan_switches.c_str(), po::bool_switch(&plan), plan_message.c_str())(
+        template_dir_switches.c_str(), po::value(&train_opts.template_dir), template_dir_message.c_str())(
+        fine_tune_switches.c_str(), po::value(&train_opts.fine_tune), fine_tune_message.c_str());
     // clang-format on
 
     po::variables_map vm;
@@ -459,10 +1324,18 @@ int main(int argc, char** argv)
 
       po::notify(vm);
 
-      if (unsteg)
-        unsteg_data(password, input_file, magic_inputs_file, mapping_file, output_file, disable_compression);
-      else
-        steg_data(password, input_file, output_file, disable_compression);
+      if (unsteg && !batch.empty())
+        unsteg_batch(password, batch, magic_inputs_file, mapping_file, output_file, tile_budget << 20);
+      else if (unsteg)
+        unsteg_data(password, input_file, magic_inputs_file, mapping_file, output_file, disable_compression,
+                    tile_budget << 20, range);
+      else {
+        train_opts.tile_budget = tile_budget << 20;
+        if (plan)
+          plan_steg(password, input_file, disable_compression, train_opts);
+        else
+          steg_data(password, input_file, output_file, disable_compression, train_opts);
+      }
     } catch (po::error& e) {
       string pre = "ERROR: ";
       cerr << pre << e.what() << endl << endl;
@@ -21,7 +21,7 @@ public:
   T (*derivative)(T);
   perceptron(size_t num_inputs, T (*activation)(T x) = tanh, T (*derivative)(T x) = sech<T>,
              bool biased = true)
-      : activation(activation), biased(biased), derivative(derivative)
+      : activation(activation), _output(0), _delta(0), biased(biased), derivative(derivative)
   {
     static default_random_engine gen;
     static uniform_real_distribution<T> dis(0.0, 1.0);
@@ -29,10 +29,23 @@ public:
       _weights.push_back(dis(gen));
   }
 
+  // Neuron with the given weights (bias last when biased), e.g. read back from a network file. Unlike the
+  // constructor above it doesn't draw from the shared generator, so it is safe to call from several threads.
+  perceptron(const vector<T>& weights, T (*activation)(T x) = tanh, T (*derivative)(T x) = sech<T>,
+             bool biased = true)
+      : _weights(weights), activation(activation), _output(0), _delta(0), biased(biased),
+        derivative(derivative)
+  {
+  }
+
+  double weighted_sum(const vector<T>& inputs)
+  {
+    return inner_product(_weights.begin(), _weights.end() - biased, inputs.begin(), 0.0);
+  }
+
   T activate(const vector<T>& inputs)
   {
-    _output = activation(inner_product(_weights.begin(), _weights.end() - biased, inputs.begin(), 0.0)) +
-              (biased ? _weights[_weights.size() - 1] : 0);
+    _output = activation(weighted_sum(inputs)) + (biased ? _weights[_weights.size() - 1] : 0);
     _delta = derivative(_output);
     return _output;
   }
@@ -62,6 +75,7 @@ public:
   void weight(size_t index, T x) { _weights[index] = x; }
   vector<T> weights() { return _weights; }
   void weights(const vector<T>& weights) { _weights = weights; }
+  size_t num_inputs() { return _weights.size() - biased; }
   T output() { return _output; }
   T delta() { return _delta; }
   void delta(T x) { _delta = x; }
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <algorithm>
+#include <fcntl.h>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "maths.h"
+
+using namespace std;
+
+// Output layer whose weights live in a memory-mapped file instead of RAM. Neurons are stored back to
+// back as { weights..., bias } and only one tile of them is mapped at a time, so peak RSS is bounded by
+// the tile budget no matter how many outputs the layer has. Activation matches perceptron: tanh on the
+// weighted sum, bias added afterwards.
+template<typename T> class tiled_layer
+{
+private:
+  int _fd;
+  size_t _outputs;
+  size_t _inputs;
+  size_t _tile;
+
+  size_t stride() { return _inputs + 1; }
+
+  // Map neurons [first, first + count) and hand their weights to f
+  template<typename F> void map_tile(size_t first, size_t count, bool writable, F f)
+  {
+    static const size_t page = sysconf(_SC_PAGESIZE);
+    size_t offset = first * stride() * sizeof(T);
+    size_t aligned = offset - offset % page;
+    size_t length = count * stride() * sizeof(T) + (offset - aligned);
+    int prot = PROT_READ | (writable ? PROT_WRITE : 0);
+    void* addr = mmap(NULL, length, prot, MAP_SHARED, _fd, aligned);
+    if (addr == MAP_FAILED) {
+      cerr << "ERROR: Could not map output layer tile" << endl;
+      exit(EXIT_FAILURE);
+    }
+    madvise(addr, length, MADV_SEQUENTIAL);
+    f(reinterpret_cast<T*>(static_cast<char*>(addr) + (offset - aligned)), first, count);
+    munmap(addr, length);
+  }
+
+public:
+  // Open (or create and randomly initialize) the weight file at path. tile_budget is the number of
+  // bytes of weights mapped at once.
+  tiled_layer(const string& path, size_t outputs, size_t inputs, size_t tile_budget, bool create)
+      : _outputs(outputs), _inputs(inputs)
+  {
+    _tile = max((size_t) 1, tile_budget / (stride() * sizeof(T)));
+    _fd = open(path.c_str(), create ? O_RDWR | O_CREAT | O_TRUNC : O_RDONLY, 0644);
+    if (_fd < 0) {
+      cerr << "ERROR: Could not open weight file '" << path << "'" << endl;
+      exit(EXIT_FAILURE);
+    }
+
+    size_t bytes = _outputs * stride() * sizeof(T);
+    if (create) {
+      if (ftruncate(_fd, bytes) != 0) {
+        cerr << "ERROR: Could not allocate weight file '" << path << "'" << endl;
+        exit(EXIT_FAILURE);
+      }
+      static default_random_engine gen;
+      static uniform_real_distribution<T> dis(0.0, 1.0);
+      for_each_tile(true, [&](T* w, size_t, size_t count) {
+        for (size_t i = 0; i < count * stride(); i++)
+          w[i] = dis(gen);
+      });
+    } else {
+      struct stat st;
+      if (fstat(_fd, &st) != 0 || (size_t) st.st_size != bytes) {
+        cerr << "ERROR: Weight file '" << path << "' does not match network topology" << endl;
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+
+  tiled_layer(const tiled_layer&) = delete;
+  tiled_layer& operator=(const tiled_layer&) = delete;
+  ~tiled_layer() { close(_fd); }
+
+  // Call f(weights, first, count) for every tile of neurons in order
+  template<typename F> void for_each_tile(bool writable, F f)
+  {
+    for (size_t first = 0; first < _outputs; first += _tile)
+      map_tile(first, min(_tile, _outputs - first), writable, f);
+  }
+
+  T activate(const T* w, const vector<T>& x)
+  {
+    return tanh((T) inner_product(w, w + _inputs, x.begin(), 0.0)) + w[_inputs];
+  }
+
+  // Evaluate output neurons [first, last) for the hidden activations x, tile by tile, calling
+  // f(idx, output). Only the tiles covering the range are mapped.
+  template<typename F> void forward(const vector<T>& x, size_t first, size_t last, F f)
+  {
+    for (; first < last; first += _tile)
+      map_tile(first, min(_tile, last - first), false, [&](T* w, size_t tile_first, size_t count) {
+        for (size_t i = 0; i < count; i++)
+          f(tile_first + i, activate(w + i * stride(), x));
+      });
+  }
+
+  template<typename F> void forward(const vector<T>& x, F f) { forward(x, 0, _outputs, f); }
+
+  // One SGD step over the whole layer towards expected. The error each neuron backpropagates into its
+  // inputs is accumulated into errors (computed with the weights from before the update, as bpnn does)
+  // and the squared error of the layer is returned. Neurons within margin of their target are skipped and
+  // counted out of num_active, as in fixed_bpnn::train_one.
+  T train_one(const vector<T>& x, const vector<T>& expected, T learning_rate, vector<T>& errors, T margin = 0,
+              size_t* num_active = NULL)
+  {
+    T sum = 0;
+    for_each_tile(true, [&](T* w, size_t first, size_t count) {
+      for (size_t i = 0; i < count; i++, w += stride()) {
+        T output = activate(w, x);
+        T error = expected[first + i] - output;
+        T delta = error * sech(output);
+        sum += error * error;
+        if (fabs(error) < margin)
+          continue;
+        if (num_active)
+          (*num_active)++;
+        for (size_t input_idx = 0; input_idx < _inputs; input_idx++) {
+          errors[input_idx] += w[input_idx] * delta;
+          w[input_idx] += learning_rate * delta * x[input_idx];
+        }
+      }
+    });
+    return sum;
+  }
+
+  // Closed-form fit of every neuron to expected for the fixed inputs x, as bpnn::solve_output_layer
+  void solve(const vector<T>& x, const vector<T>& expected, T ridge = 0)
+  {
+    T norm = inner_product(x.begin(), x.end(), x.begin(), 0.0) + ridge;
+    for_each_tile(true, [&](T* w, size_t first, size_t count) {
+      for (size_t i = 0; i < count; i++, w += stride()) {
+        T target = atanh(clamp<T>(expected[first + i] - w[_inputs], -1 + 1e-6, 1 - 1e-6));
+        T step = (target - inner_product(w, w + _inputs, x.begin(), (T) 0)) / norm;
+        for (size_t input_idx = 0; input_idx < _inputs; input_idx++)
+          w[input_idx] += step * x[input_idx];
+      }
+    });
+  }
+
+  size_t outputs() { return _outputs; }
+  size_t inputs() { return _inputs; }
+  size_t tile() { return _tile; }
+};
@@ -1,10 +1,19 @@
 #pragma once
 
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
 #include <fstream>
 #include <iomanip>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
 #include <vector>
 
+#include "types.h"
+
 using namespace std;
 
 template<typename T> ostream& operator<<(ostream& out, const vector<T>& v)
@@ -43,3 +52,82 @@ static string read_file(const string& path)
   }
   return string{istreambuf_iterator<char>{input_file}, {}};
 }
+
+// Read-only bytes of an input file. Regular files are memory-mapped so the payload is read once, straight
+// from the page cache, and "-" (or anything that can't be mapped, like a pipe) is read in large chunks.
+class input_view
+{
+private:
+  const u8* _data = NULL;
+  size_t _size = 0;
+  void* _map = MAP_FAILED;
+  vector<u8> _buffer;
+
+public:
+  input_view(const string& path)
+  {
+    int fd = path == "-" ? STDIN_FILENO : open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      cerr << "Could not open the file - '" << path << "'" << endl;
+      exit(EXIT_FAILURE);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+      _map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (_map != MAP_FAILED) {
+        madvise(_map, st.st_size, MADV_SEQUENTIAL);
+        _data = static_cast<const u8*>(_map);
+        _size = st.st_size;
+      }
+    }
+
+    if (_map == MAP_FAILED) {
+      const size_t chunk = 1 << 20;
+      ssize_t n;
+      do {
+        _buffer.resize(_size + chunk);
+        n = read(fd, _buffer.data() + _size, chunk);
+        if (n < 0 && errno == EINTR)
+          continue;
+        if (n < 0) {
+          cerr << "Could not read the file - '" << path << "': " << strerror(errno) << endl;
+          exit(EXIT_FAILURE);
+        }
+        _size += n;
+      } while (n != 0);
+      _buffer.resize(_size);
+      _data = _buffer.data();
+    }
+
+    if (fd != STDIN_FILENO)
+      close(fd);
+  }
+
+  input_view(const input_view&) = delete;
+  input_view& operator=(const input_view&) = delete;
+
+  ~input_view()
+  {
+    if (_map != MAP_FAILED)
+      munmap(_map, _size);
+  }
+
+  const u8* data() const { return _data; }
+  size_t size() const { return _size; }
+};
+
+// Run f(i) for every i in [0, n) across all hardware threads
+template<typename F> void parallel_for(size_t n, F f)
+{
+  atomic<size_t> next(0);
+  vector<thread> workers;
+  size_t num_workers = min<size_t>(max(1u, thread::hardware_concurrency()), n);
+  for (size_t worker = 0; worker < num_workers; worker++)
+    workers.emplace_back([&]() {
+      for (size_t i; (i = next++) < n;)
+        f(i);
+    });
+  for (auto& worker : workers)
+    worker.join();
+}